@@ -39,12 +39,13 @@ mo_create_image_dirs() {
 # Pass any extra gcc flags jpegresize.c needs to find libjpeg on this
 # platform (e.g. Homebrew's -I/-L on macOS; empty on Ubuntu, where
 # apt already puts libjpeg headers on the default search path).
+# jpegresize.c includes jpegresize.h, which must sit next to it.
 mo_build_image_helpers() {
     extra_gcc_flags="${1:-}"
 
     if [ ! -f /usr/local/bin/jpegresize ]; then
         # shellcheck disable=SC2086
-        sudo gcc script/jpegresize.c $extra_gcc_flags -ljpeg -lm -O2 \
+        sudo gcc script/jpegresize.c $extra_gcc_flags -ljpeg -lm -lpthread -O2 \
             -o /usr/local/bin/jpegresize
         echo "Created and installed jpegresize executable"
     else
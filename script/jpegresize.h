@@ -0,0 +1,104 @@
+/* In-memory interface to jpegresize, for calling it from other programs
+/* (e.g., Ruby via FFI) on images they already have in memory.  Build it as
+/* a shared library with:
+/*
+/*   gcc -shared -fPIC -fvisibility=hidden -DJR_LIBRARY jpegresize.c \
+/*       -ljpeg -lm -lpthread -O2 -o libjpegresize.so
+/*
+/* Only the jr_ functions below are exported (see JR_API); everything else
+/* is hidden, so it can't clash with anything else loaded in the process.
+/* Nothing is shared between calls, so any number of threads may resize at
+/* once.  See the jpegresize --help for what the parameters mean.
+*/
+
+#ifndef JPEGRESIZE_H
+#define JPEGRESIZE_H
+
+#include <stddef.h>
+
+#if defined(JR_LIBRARY) && defined(__GNUC__)
+#define JR_API __attribute__((visibility("default")))
+#else
+#define JR_API
+#endif
+
+#define JR_FLAT      1
+#define JR_LINEAR    2
+#define JR_HERMITE   3
+#define JR_CATROM    4
+#define JR_MITCHELL  5
+#define JR_KEYS      6
+#define JR_LANCZOS   7
+
+#define JR_SET_SIZE  1
+#define JR_MAX_SIZE  2
+#define JR_MIN_SIZE  3
+#define JR_SET_AREA  4
+#define JR_MAX_AREA  5
+#define JR_MIN_AREA  6
+#define JR_CROP      7
+
+/* How to resize (see jr_defaults). */
+typedef struct jr_params {
+    int filter;    /* filter type: JR_FLAT, etc. */
+    float arg1;    /* first argument to filter: M for --catrom, B for --keys,
+                   /* or N for --lanczos */
+    float arg2;    /* second argument to filter: C for --keys */
+    float radius;  /* radius of convolution kernel, > 0 */
+    float sharp;   /* amount to sharpen output, >= 0 */
+    int mode;      /* resize mode: JR_SET_SIZE, etc. */
+    int prescale;  /* boolean: let libjpeg reduce image while decoding? */
+    int auto_orient; /* boolean: turn outputs per EXIF Orientation tag? */
+    int fixed;     /* boolean: resample in fixed point instead of float? */
+    int threads;   /* number of worker threads (see --jobs) */
+    int optimize;  /* boolean: optimize Huffman tables?  -1 = choose by size */
+    int progressive; /* boolean: progressive JPEGs?  -1 = choose by size */
+    int chroma;    /* chroma subsampling: 444, 422, 420, or 0 = choose by size */
+    int copy_markers; /* boolean: copy APPn and COM markers from input? */
+    int ycc;       /* boolean: resample Y, Cb and Cr planes as stored? */
+    int band_encode; /* boolean: restart markers between bands of outputs,
+                   /* which are encoded in parallel if threads > 1? */
+} jr_params;
+
+/* One output image.  Caller fills in the size, quality, raw and webp;
+/* jr_resize fills in the rest, or leaves data NULL if it fails. */
+typedef struct jr_output {
+    int width;     /* requested width, replaced by actual width (as turned
+                   /* by auto_orient) */
+    int height;    /* requested height, replaced by actual height */
+    int quality;   /* jpeg quality: 0 to 100, or -1 to choose by size */
+    int raw;       /* boolean: return samples instead of a JPEG? */
+    int webp;      /* boolean: return a WebP instead of a JPEG? (only if
+                   /* built with -DHAVE_WEBP -lwebp) */
+    int components; /* number of samples per pixel (set by jr_resize) */
+    unsigned char *data; /* compressed image, or raw samples row by row;
+                   /* free with jr_free */
+    unsigned long size;  /* size of data */
+} jr_output;
+
+/* Seconds spent in each stage of the last jr_resize. */
+typedef struct jr_stats {
+    double decode;     /* reading and decompressing input */
+    double horizontal; /* horizontal pass of convolution (all threads) */
+    double vertical;   /* vertical pass of convolution (all threads) */
+    double encode;     /* compressing outputs */
+} jr_stats;
+
+/* Fill in the same defaults as the command line uses. */
+JR_API void jr_defaults(jr_params *params);
+
+/* Resize the JPEG image in (len bytes) into each of the given outputs
+/* in one pass.  Returns 0 if successful, or -1 on error (see jr_error). */
+JR_API int jr_resize(const unsigned char *in, size_t len, const jr_params *params,
+                     jr_output *outputs, int num_outputs);
+
+/* Explain why the last jr_resize in this thread failed. */
+JR_API const char *jr_error(void);
+
+/* Get timing of the last jr_resize in this thread. */
+JR_API void jr_last_stats(jr_stats *stats);
+
+/* Free output data. */
+JR_API void jr_free(void *ptr);
+
+#endif
@@ -0,0 +1,602 @@
+/* Build with: gcc -DJR_LIBRARY jpegresize.c jpegresize_bench.c -ljpeg -lm -lpthread -O2 -o jpegresize_bench
+/*
+/* Benchmark and accuracy suite for jpegresize.  Generates (once) a corpus
+/* of synthetic JPEGs covering our upload mix -- 2 to 50 megapixels,
+/* grayscale, RGB and CMYK, baseline and progressive, portrait and
+/* landscape -- then:
+/*
+/*   speed:     makes the same five renditions as Image::Processor from each
+/*              image, and reports time spent decoding, in each pass of the
+/*              convolution, and encoding, plus throughput in input
+/*              megapixels per second and peak memory.
+/*
+/*   accuracy:  resizes a few of them with each filter, and compares the
+/*              samples (before compression) from the fast paths against
+/*              plain float without prescaling, giving PSNR and SSIM.
+/*
+/*   parity:    (only with --parity) resizes each JPEG in test/images with
+/*              each filter to each rendition size, with and without
+/*              prescaling, in fixed point and in float, and fails if any
+/*              sample differs by more than 1.  This has to pass before
+/*              production uses --fixed.  Run it from the top of the repo,
+/*              or give the directory with -t.
+/*
+/* The corpus is the same on every machine, so numbers from before and after
+/* a change are directly comparable.  Run it on an otherwise idle machine.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <jpeglib.h>
+#include "jpegresize.h"
+
+#define USAGE "jpegresize_bench [-d <corpus dir>] [-n <runs>] [-j <threads>] [--quick] [--speed | --accuracy | --parity [-t <images dir>]]"
+
+/* One image in the corpus. */
+struct image {
+    char *name;    /* basename of file in corpus dir */
+    int w, h, z;   /* size and number of components */
+    int progressive; /* boolean: progressive scans instead of baseline? */
+    int big;       /* boolean: skip with --quick? */
+    int check;     /* boolean: use for accuracy tests? */
+};
+
+struct image corpus[] = {
+    { "rgb-2mp-landscape",        1728, 1152, 3, 0, 0, 1 },
+    { "rgb-6mp-portrait-prog",    2000, 3000, 3, 1, 0, 0 },
+    { "gray-8mp-landscape",       3456, 2304, 1, 0, 0, 1 },
+    { "rgb-12mp-landscape",       4000, 3000, 3, 0, 0, 0 },
+    { "cmyk-12mp-portrait",       3000, 4000, 4, 0, 0, 1 },
+    { "rgb-24mp-landscape-prog",  6000, 4000, 3, 1, 1, 0 },
+    { "rgb-50mp-landscape",       8660, 5773, 3, 0, 1, 0 },
+};
+#define NUM_IMAGES (int)(sizeof(corpus) / sizeof(struct image))
+
+/* Renditions Image::Processor makes (see SIZE_CONVERSIONS). */
+int sizes[]     = { 1280, 960, 640, 320, 160 };
+int qualities[] = {   93,  94,  95,  95,  95 };
+#define NUM_SIZES 5
+
+/* Filters to check accuracy of: one of each kind calc_factor knows. */
+struct filter {
+    char *name;
+    int filter;
+    float arg1, arg2;
+} filters[] = {
+    { "flat",      JR_FLAT,    0.0,     0.0 },
+    { "linear",    JR_LINEAR,  0.0,     0.0 },
+    { "hermite",   JR_HERMITE, 0.0,     0.0 },
+    { "catrom",    JR_CATROM,  1.0,     0.0 },
+    { "mitchell",  JR_KEYS,    1.0/3.0, 1.0/3.0 },
+    { "lanczos2",  JR_LANCZOS, 2.0,     0.0 },
+    { "lanczos3",  JR_LANCZOS, 3.0,     0.0 },
+};
+#define NUM_FILTERS (int)(sizeof(filters) / sizeof(struct filter))
+
+void  make_image(char*, struct image*);
+int   synth(int, int, int, int, int);
+unsigned char* read_file(char*, size_t*);
+void  run_speed(char*, struct image*, int, jr_params*);
+void  run_accuracy(char*, struct image*, jr_params*);
+int   run_parity(char*, jr_params*);
+void  jpeg_size(unsigned char*, size_t, int*, int*);
+int   max_diff(unsigned char*, unsigned char*, long);
+void  resize_or_die(unsigned char*, size_t, jr_params*, jr_output*, int);
+double calc_psnr(unsigned char*, unsigned char*, int, int, int);
+double calc_ssim(unsigned char*, unsigned char*, int, int, int);
+double now(void);
+
+/* --------------------------- */
+/*  Main program.              */
+/* --------------------------- */
+
+int main(int argc, char **argv) {
+    char *dir = "/tmp/jpegresize_corpus"; /* where corpus lives */
+    int runs = 3;     /* time each image this many times and take best */
+    int quick = 0;    /* boolean: skip the biggest images? */
+    int speed = 1;    /* boolean: run speed tests? */
+    int accuracy = 1; /* boolean: run accuracy tests? */
+    int parity = 0;   /* boolean: run parity tests instead? */
+    char *images = "test/images"; /* real images for parity tests */
+    jr_params params; /* settings for speed tests */
+    char file[1024];
+    struct stat st;
+    int i;
+
+    jr_defaults(&params);
+    params.mode = JR_MAX_SIZE;
+    for (i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "-d") && i+1 < argc) {
+            dir = argv[++i];
+        } else if (!strcmp(argv[i], "-n") && i+1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-j") && i+1 < argc) {
+            params.threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--fixed")) {
+            params.fixed = 1;
+        } else if (!strcmp(argv[i], "--no-prescale")) {
+            params.prescale = 0;
+        } else if (!strcmp(argv[i], "--quick")) {
+            quick = 1;
+        } else if (!strcmp(argv[i], "--speed")) {
+            accuracy = 0;
+        } else if (!strcmp(argv[i], "--accuracy")) {
+            speed = 0;
+        } else if (!strcmp(argv[i], "--parity")) {
+            parity = 1;
+        } else if (!strcmp(argv[i], "-t") && i+1 < argc) {
+            images = argv[++i];
+        } else {
+            fprintf(stderr, "USAGE: %s\n", USAGE);
+            exit(1);
+        }
+    }
+    if (runs < 1) runs = 1;
+
+    /* Parity tests use real images, and are a pass/fail check. */
+    if (parity) {
+        if ((i = run_parity(images, &params)) != 0)
+            printf("parity: %d FAILED\n", i);
+        else
+            printf("parity: all passed\n");
+        exit(i != 0);
+    }
+
+    /* Make any of the corpus that isn't there yet. */
+    mkdir(dir, 0755);
+    for (i=0; i<NUM_IMAGES; i++) {
+        if (quick && corpus[i].big) continue;
+        snprintf(file, sizeof(file), "%s/%s.jpg", dir, corpus[i].name);
+        if (stat(file, &st) == 0) continue;
+        fprintf(stderr, "making %s\n", file);
+        make_image(file, corpus + i);
+    }
+
+    if (speed) {
+        printf("speed: best of %d, %d thread(s), %s, %s; times in seconds\n",
+               runs, params.threads, params.fixed ? "fixed" : "float",
+               params.prescale ? "prescale" : "no prescale");
+        printf("%-24s %10s %5s %7s %7s %7s %7s %7s %7s %8s\n", "image", "size",
+               "MP", "decode", "horiz", "vert", "encode", "total", "MP/s",
+               "peak MB");
+        for (i=0; i<NUM_IMAGES; i++)
+            if (!quick || !corpus[i].big)
+                run_speed(dir, corpus + i, runs, &params);
+        printf("\n");
+    }
+
+    if (accuracy) {
+        printf("accuracy: PSNR (dB) / SSIM of samples vs float without prescale\n");
+        printf("%-24s %-9s %-15s", "image", "filter", "variant");
+        for (i=0; i<NUM_SIZES; i+=2)
+            printf(" %7dpx     ", sizes[i]);
+        printf("\n");
+        for (i=0; i<NUM_IMAGES; i++)
+            if (corpus[i].check && (!quick || i == 0))
+                run_accuracy(dir, corpus + i, &params);
+    }
+    exit(0);
+}
+
+/* ------------------------------- */
+/*  Speed.                         */
+/* ------------------------------- */
+
+/* Time the renditions of one image.  Does it in a child process so that
+/* peak memory is for this image alone. */
+void run_speed(dir, im, runs, params)
+char *dir;
+struct image *im;
+int runs;
+jr_params *params;
+{
+    jr_output outputs[NUM_SIZES];
+    jr_stats stats, best;
+    struct rusage ru;
+    unsigned char *data;
+    char file[1024];
+    double t, total, mp;
+    size_t len;
+    int pid, status, r, i;
+
+    fflush(stdout);
+    if ((pid = fork()) != 0) {
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || status) {
+            fprintf(stderr, "benchmark of %s failed\n", im->name);
+            exit(1);
+        }
+        return;
+    }
+
+    snprintf(file, sizeof(file), "%s/%s.jpg", dir, im->name);
+    data = read_file(file, &len);
+    memset(&best, 0, sizeof(best));
+    for (total=1e30, r=0; r<runs; r++) {
+        for (i=0; i<NUM_SIZES; i++) {
+            memset(outputs + i, 0, sizeof(jr_output));
+            outputs[i].width = outputs[i].height = sizes[i];
+            outputs[i].quality = qualities[i];
+        }
+        t = now();
+        resize_or_die(data, len, params, outputs, NUM_SIZES);
+        t = now() - t;
+        jr_last_stats(&stats);
+        for (i=0; i<NUM_SIZES; i++)
+            jr_free(outputs[i].data);
+        if (t < total) {
+            total = t;
+            best  = stats;
+        }
+    }
+
+    /* Linux gives peak memory in kilobytes, Mac OS in bytes. */
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    ru.ru_maxrss /= 1024;
+#endif
+    mp = (double)im->w * im->h / 1e6;
+    printf("%-24s %5dx%-4d %5.1f %7.3f %7.3f %7.3f %7.3f %7.3f %7.1f %8.1f\n",
+           im->name, im->w, im->h, mp, best.decode, best.horizontal,
+           best.vertical, best.encode, total, mp / total, ru.ru_maxrss / 1024.0);
+    fflush(stdout);
+    exit(0);
+}
+
+/* ------------------------------- */
+/*  Accuracy.                      */
+/* ------------------------------- */
+
+/* Compare each filter's fast paths against plain float for one image, at
+/* every other rendition size. */
+void run_accuracy(dir, im, defaults)
+char *dir;
+struct image *im;
+jr_params *defaults;
+{
+    static char *variants[] = { "prescale", "fixed", "prescale+fixed" };
+    jr_output ref[NUM_SIZES], out[NUM_SIZES];
+    jr_params params;
+    unsigned char *data;
+    char file[1024];
+    size_t len;
+    int f, v, i;
+
+    snprintf(file, sizeof(file), "%s/%s.jpg", dir, im->name);
+    data = read_file(file, &len);
+    for (f=0; f<NUM_FILTERS; f++) {
+        params = *defaults;
+        params.filter   = filters[f].filter;
+        params.arg1     = filters[f].arg1;
+        params.arg2     = filters[f].arg2;
+        params.prescale = 0;
+        params.fixed    = 0;
+        for (i=0; i<NUM_SIZES; i++) {
+            memset(ref + i, 0, sizeof(jr_output));
+            ref[i].width = ref[i].height = sizes[i];
+            ref[i].raw = 1;
+        }
+        resize_or_die(data, len, &params, ref, NUM_SIZES);
+
+        for (v=0; v<3; v++) {
+            params.prescale = v != 1;
+            params.fixed    = v != 0;
+            for (i=0; i<NUM_SIZES; i++) {
+                memset(out + i, 0, sizeof(jr_output));
+                out[i].width = out[i].height = sizes[i];
+                out[i].raw = 1;
+            }
+            resize_or_die(data, len, &params, out, NUM_SIZES);
+            printf("%-24s %-9s %-15s", im->name, filters[f].name, variants[v]);
+            for (i=0; i<NUM_SIZES; i+=2)
+                printf("   %5.2f %6.4f", calc_psnr(ref[i].data, out[i].data,
+                       ref[i].width, ref[i].height, ref[i].components),
+                       calc_ssim(ref[i].data, out[i].data, ref[i].width,
+                       ref[i].height, ref[i].components));
+            printf("\n");
+            for (i=0; i<NUM_SIZES; i++)
+                jr_free(out[i].data);
+        }
+        for (i=0; i<NUM_SIZES; i++)
+            jr_free(ref[i].data);
+    }
+    free(data);
+}
+
+/* Peak signal to noise ratio in dB, 99 if identical. */
+double calc_psnr(a, b, w, h, z)
+unsigned char *a, *b;
+int w, h, z;
+{
+    double d, sum = 0;
+    long i, n = (long)w * h * z;
+
+    for (i=0; i<n; i++) {
+        d = (double)a[i] - b[i];
+        sum += d * d;
+    }
+    return(sum == 0 ? 99.0 : 10.0 * log10(255.0 * 255.0 * n / sum));
+}
+
+/* Mean structural similarity over 8x8 windows every 4 pixels, averaged
+/* over all components. */
+double calc_ssim(a, b, w, h, z)
+unsigned char *a, *b;
+int w, h, z;
+{
+    double c1 = 6.5025, c2 = 58.5225; /* (0.01 * 255)^2, (0.03 * 255)^2 */
+    double sa, sb, saa, sbb, sab, ma, mb, va, vb, cov, total = 0;
+    int x, y, i, j, k, p, n = 0;
+
+    for (k=0; k<z; k++)
+    for (y=0; y+8<=h; y+=4)
+    for (x=0; x+8<=w; x+=4) {
+        sa = sb = saa = sbb = sab = 0;
+        for (j=0; j<8; j++)
+        for (i=0; i<8; i++) {
+            p = ((y + j) * w + x + i) * z + k;
+            sa  += a[p];
+            sb  += b[p];
+            saa += a[p] * a[p];
+            sbb += b[p] * b[p];
+            sab += a[p] * b[p];
+        }
+        ma  = sa / 64;
+        mb  = sb / 64;
+        va  = saa / 64 - ma * ma;
+        vb  = sbb / 64 - mb * mb;
+        cov = sab / 64 - ma * mb;
+        total += (2 * ma * mb + c1) * (2 * cov + c2) /
+                 ((ma * ma + mb * mb + c1) * (va + vb + c2));
+        n++;
+    }
+    return(n ? total / n : 1.0);
+}
+
+/* ------------------------------- */
+/*  Parity.                        */
+/* ------------------------------- */
+
+/* Check fixed point against float for each JPEG in dir, the same way
+/* --parity does: same decode, same trimmed taps, and no sample may differ
+/* by more than 1.  Each filter makes every rendition size (as --max-size,
+/* like Image::Processor), with and without prescaling.  Small images are
+/* also enlarged 12x without prescaling, where the float path once fell
+/* back to a junk value at a corner (fixed by trimming taps once for both,
+/* see trim_taps).  Prints the worst difference for each image and filter,
+/* and returns how many failed. */
+int run_parity(dir, defaults)
+char *dir;
+jr_params *defaults;
+{
+    jr_output ref[NUM_SIZES], out[NUM_SIZES];
+    jr_params params;
+    struct dirent *e;
+    unsigned char *data;
+    char file[1024];
+    size_t len;
+    DIR *dh;
+    int f, v, i, n, d, worst, w, h, failed = 0;
+    char *ext;
+
+    if ((dh = opendir(dir)) == NULL) {
+        fprintf(stderr, "can't open %s\n", dir);
+        exit(1);
+    }
+    printf("parity: largest difference of fixed point from float\n");
+    while ((e = readdir(dh)) != NULL) {
+        if (!(ext = strrchr(e->d_name, '.')) || strcasecmp(ext, ".jpg")) continue;
+        snprintf(file, sizeof(file), "%s/%s", dir, e->d_name);
+        data = read_file(file, &len);
+        jpeg_size(data, len, &w, &h);
+        for (f=0; f<NUM_FILTERS; f++) {
+            params = *defaults;
+            params.filter = filters[f].filter;
+            params.arg1   = filters[f].arg1;
+            params.arg2   = filters[f].arg2;
+            for (worst=0, v=0; v<3; v++) {
+                n = v < 2 ? NUM_SIZES : 1;
+                if (v == 2 && w * 12 > 2000) continue;
+                params.mode     = v < 2 ? JR_MAX_SIZE : JR_SET_SIZE;
+                params.prescale = v == 0;
+                for (i=0; i<n; i++) {
+                    memset(ref + i, 0, sizeof(jr_output));
+                    ref[i].width  = v < 2 ? sizes[i] : w * 12;
+                    ref[i].height = v < 2 ? sizes[i] : h * 12;
+                    ref[i].raw    = 1;
+                    out[i] = ref[i];
+                }
+                params.fixed = 0;
+                resize_or_die(data, len, &params, ref, n);
+                params.fixed = 1;
+                resize_or_die(data, len, &params, out, n);
+                for (i=0; i<n; i++) {
+                    d = max_diff(ref[i].data, out[i].data, (long)ref[i].width *
+                                 ref[i].height * ref[i].components);
+                    if (d > worst) worst = d;
+                    if (d > 1)
+                        printf("FAILED: %s %s %dx%d%s: %d\n", e->d_name,
+                               filters[f].name, ref[i].width, ref[i].height,
+                               params.prescale ? "" : " no prescale", d);
+                    jr_free(ref[i].data);
+                    jr_free(out[i].data);
+                }
+            }
+            printf("%-28s %-9s %d\n", e->d_name, filters[f].name, worst);
+            if (worst > 1) failed++;
+        }
+        free(data);
+    }
+    closedir(dh);
+    return(failed);
+}
+
+/* Read the size of a JPEG image in memory. */
+void jpeg_size(data, len, w, h)
+unsigned char *data;
+size_t len;
+int *w, *h;
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr jerr;
+
+    dinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&dinfo);
+    jpeg_mem_src(&dinfo, data, len);
+    jpeg_read_header(&dinfo, TRUE);
+    *w = dinfo.image_width;
+    *h = dinfo.image_height;
+    jpeg_destroy_decompress(&dinfo);
+}
+
+/* Largest difference between corresponding samples. */
+int max_diff(a, b, n)
+unsigned char *a, *b;
+long n;
+{
+    long i;
+    int d, big = 0;
+
+    for (i=0; i<n; i++)
+        if ((d = abs(a[i] - b[i])) > big) big = d;
+    return(big);
+}
+
+/* ------------------------------- */
+/*  Corpus.                        */
+/* ------------------------------- */
+
+/* Write one synthetic image: smooth gradients, hard-edged shapes and fine
+/* texture, so that every part of the filter has something to do. */
+void make_image(file, im)
+char *file;
+struct image *im;
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPLE *line;
+    FILE *fh;
+    int x, y, k;
+
+    if ((fh = fopen(file, "wb")) == NULL) {
+        fprintf(stderr, "can't open %s for writing\n", file);
+        exit(1);
+    }
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, fh);
+    cinfo.image_width = im->w;
+    cinfo.image_height = im->h;
+    cinfo.input_components = im->z;
+    cinfo.in_color_space = im->z == 1 ? JCS_GRAYSCALE :
+                           im->z == 4 ? JCS_CMYK : JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 92, TRUE);
+    if (im->progressive)
+        jpeg_simple_progression(&cinfo);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    line = (JSAMPLE*)malloc(im->w * im->z);
+    for (y=0; y<im->h; y++) {
+        for (x=0; x<im->w; x++)
+            for (k=0; k<im->z; k++)
+                line[x*im->z+k] = synth(x, y, k, im->w, im->h);
+        jpeg_write_scanlines(&cinfo, &line, 1);
+    }
+    free(line);
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    fclose(fh);
+}
+
+/* Sample k of pixel x, y in a w x h synthetic image.  Only depends on
+/* position relative to the size, so it looks alike at any size. */
+int synth(x, y, k, w, h)
+int x, y, k, w, h;
+{
+    double u = (double)x / w, v = (double)y / h;
+    double d, f;
+    unsigned int n;
+
+    /* Smooth background. */
+    f = 128 + 60 * sin(6.0 * u + 2.0 * k) * cos(4.0 * v - k);
+
+    /* Rings of increasing frequency in the middle (aliasing test). */
+    d = hypot(u - 0.5, (v - 0.5) * h / w);
+    if (d < 0.2)
+        f += 50 * sin(d * d * 2500.0);
+
+    /* Hard-edged bars and a disc (ringing test). */
+    if (u > 0.1 && u < 0.3 && ((int)(v * 40) & 1))
+        f = 230 - 40 * k;
+    if (hypot(u - 0.8, v - 0.7) < 0.1)
+        f = 20 + 30 * k;
+
+    /* Fine texture, like foliage or grain. */
+    n = (unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u ^ k * 83492791u;
+    n = (n ^ (n >> 13)) * 1274126177u;
+    f += (int)(n >> 28) - 8;
+
+    return(f < 0 ? 0 : f > 255 ? 255 : (int)f);
+}
+
+/* ------------------------------- */
+/*  Utilities.                     */
+/* ------------------------------- */
+
+/* Read whole file into memory. */
+unsigned char *read_file(file, len)
+char *file;
+size_t *len;
+{
+    unsigned char *data;
+    FILE *fh;
+    long n;
+
+    if ((fh = fopen(file, "rb")) == NULL) {
+        fprintf(stderr, "can't open %s for reading\n", file);
+        exit(1);
+    }
+    fseek(fh, 0, SEEK_END);
+    n = ftell(fh);
+    rewind(fh);
+    data = (unsigned char*)malloc(n);
+    if (fread(data, 1, n, fh) != (size_t)n) {
+        fprintf(stderr, "error reading %s\n", file);
+        exit(1);
+    }
+    fclose(fh);
+    *len = n;
+    return(data);
+}
+
+void resize_or_die(data, len, params, outputs, num_outputs)
+unsigned char *data;
+size_t len;
+jr_params *params;
+jr_output *outputs;
+int num_outputs;
+{
+    if (jr_resize(data, len, params, outputs, num_outputs)) {
+        fprintf(stderr, "resize failed: %s\n", jr_error());
+        exit(1);
+    }
+}
+
+/* Wall clock time in seconds. */
+double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
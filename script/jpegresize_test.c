@@ -0,0 +1,260 @@
+/* Build with: gcc -fsanitize=address -g -DJR_LIBRARY jpegresize.c jpegresize_test.c -ljpeg -lm -lpthread -O1 -o jpegresize_test
+/*        and: gcc -fsanitize=address -g jpegresize.c -ljpeg -lm -lpthread -O1 -o jpegresize
+/*
+/* Regression tests for jpegresize: the ways it has failed before, each
+/* run against the command line (or --serve) given, and the library this
+/* is linked with.  Run it from the top of the repo, or give the directory
+/* holding test/images' JPEGs with -t:
+/*
+/*   script/jpegresize_test script/jpegresize
+/*
+/* Prints a line for each test and exits 1 if any failed.  Build both with
+/* AddressSanitizer as above, since some of what these check for (double
+/* frees, say) doesn't always crash otherwise.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "jpegresize.h"
+
+#define USAGE "jpegresize_test [-t <images dir>] <jpegresize>"
+
+char *bin;         /* jpegresize to test */
+char *images = "test/images"; /* where test images are */
+char  tmp[64];     /* temp dir for outputs */
+
+int   test_failed_output(void);
+int   test_failed_job(void);
+int   test_library_failure(void);
+int   test_dhash_slots(void);
+int   run(char*, ...);
+char* read_text(char*);
+int   exists(char*);
+
+/* --------------------------- */
+/*  Main program.              */
+/* --------------------------- */
+
+struct test {
+    char *name;
+    int (*func)(void);
+} tests[] = {
+    { "later output fails after earlier one grew",   test_failed_output },
+    { "--serve job fails after earlier output grew", test_failed_job },
+    { "jr_resize fails after earlier output grew",   test_library_failure },
+    { "--serve --dhash job with more outputs",       test_dhash_slots },
+};
+#define NUM_TESTS (int)(sizeof(tests) / sizeof(struct test))
+
+int main(int argc, char **argv) {
+    int i, failed = 0;
+
+    for (i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "-t") && i+1 < argc) {
+            images = argv[++i];
+        } else if (argv[i][0] != '-' && !bin) {
+            bin = argv[i];
+        } else {
+            fprintf(stderr, "USAGE: %s\n", USAGE);
+            exit(1);
+        }
+    }
+    if (!bin) {
+        fprintf(stderr, "USAGE: %s\n", USAGE);
+        exit(1);
+    }
+    /* Make AddressSanitizer errors look like crashes, not ordinary failures,
+    /* and don't count memory --serve keeps until it exits as leaked. */
+    setenv("ASAN_OPTIONS", "exitcode=134:detect_leaks=0", 0);
+    strcpy(tmp, "/tmp/jpegresize_test.XXXXXX");
+    if (!mkdtemp(tmp)) {
+        fprintf(stderr, "can't make temp dir\n");
+        exit(1);
+    }
+
+    for (i=0; i<NUM_TESTS; i++) {
+        fflush(stdout);
+        if (tests[i].func()) {
+            printf("FAILED: %s\n", tests[i].name);
+            failed++;
+        } else {
+            printf("ok: %s\n", tests[i].name);
+        }
+    }
+    run("rm -rf '%s'", tmp);
+    if (failed)
+        printf("%d of %d FAILED\n", failed, NUM_TESTS);
+    else
+        printf("all %d passed\n", NUM_TESTS);
+    exit(failed != 0);
+}
+
+/* ------------------------------- */
+/*  Tests.                         */
+/* ------------------------------- */
+
+/* An output that fails (here, can't be opened) after an earlier one has
+/* had its compressed buffer grow past jpeg_mem_dest's first 4 KB (here,
+/* by copying perf.jpg's 30 KB of markers) used to free that buffer twice.
+/* It should just fail cleanly, leaving neither output behind. */
+int test_failed_output()
+{
+    if (run("'%s' --copy-markers --max-size %s/perf.jpg 320:%s/ok.jpg "
+            "160:%s/no/such/dir/x.jpg 2>/dev/null", bin, images, tmp, tmp) != 1)
+        return(1);
+    return(exists("ok.jpg"));
+}
+
+/* Same for --serve, where it used to abort the whole server after
+/* replying.  The next job should still work. */
+int test_failed_job()
+{
+    FILE *fh;
+    char file[128], *text;
+    int bad;
+
+    snprintf(file, sizeof(file), "%s/jobs", tmp);
+    if ((fh = fopen(file, "w")) == NULL) return(1);
+    fprintf(fh, "{\"id\": 1, \"input\": \"%s/perf.jpg\", \"outputs\": "
+            "[\"320:%s/a.jpg\", \"160:%s/no/such/dir/x.jpg\"]}\n", images, tmp, tmp);
+    fprintf(fh, "{\"id\": 2, \"input\": \"%s/perf.jpg\", \"outputs\": "
+            "[\"320:%s/b.jpg\"]}\n", images, tmp);
+    fclose(fh);
+
+    if (run("'%s' --serve - --copy-markers < %s/jobs > %s/replies 2>/dev/null",
+            bin, tmp, tmp) != 0)
+        return(1);
+    text = read_text("replies");
+    bad = !text || !strstr(text, "\"id\": 1, \"ok\": false") ||
+          !strstr(text, "\"id\": 2, \"ok\": true") || !exists("b.jpg");
+    free(text);
+    return(bad);
+}
+
+/* Same for the library, where it used to crash the host process instead
+/* of returning -1.  The second output fails because it wants WebP, which
+/* this isn't built with (with -DHAVE_WEBP, it is too big for WebP instead).
+/* The next call should still work. */
+int test_library_failure()
+{
+    jr_params params;
+    jr_output out[2];
+    unsigned char *data;
+    char file[1024];
+    size_t len;
+    FILE *fh;
+    int bad;
+
+    snprintf(file, sizeof(file), "%s/perf.jpg", images);
+    if ((fh = fopen(file, "rb")) == NULL) return(1);
+    fseek(fh, 0, SEEK_END);
+    len = ftell(fh);
+    rewind(fh);
+    data = (unsigned char*)malloc(len);
+    len = fread(data, 1, len, fh);
+    fclose(fh);
+
+    jr_defaults(&params);
+    params.copy_markers = 1;
+    memset(out, 0, sizeof(out));
+    out[0].width = out[0].height = 320;
+    out[0].quality = -1;
+    out[1].width = out[1].height = 20000;
+    out[1].quality = -1;
+    out[1].webp = 1;
+    params.mode = JR_SET_SIZE;
+    bad = jr_resize(data, len, &params, out, 2) != -1 || out[0].data ||
+          out[1].data || !*jr_error();
+
+    out[1].width = out[1].height = 160;
+    out[1].webp = 0;
+    params.mode = JR_MAX_SIZE;
+    if (jr_resize(data, len, &params, out, 2) || !out[0].data || !out[1].data)
+        bad = 1;
+    jr_free(out[0].data);
+    jr_free(out[1].data);
+    free(data);
+    return(bad);
+}
+
+/* With --serve --dhash, the output slot after a job's last output is the
+/* dHash grid.  A later job with more outputs used to find that slot still
+/* marked as the grid, and reply ok without writing that output. */
+int test_dhash_slots()
+{
+    FILE *fh;
+    char file[128], *text;
+    int bad;
+
+    snprintf(file, sizeof(file), "%s/jobs", tmp);
+    if ((fh = fopen(file, "w")) == NULL) return(1);
+    fprintf(fh, "{\"id\": 1, \"input\": \"%s/perf.jpg\", \"outputs\": "
+            "[\"100:%s/s1.jpg\"]}\n", images, tmp);
+    fprintf(fh, "{\"id\": 2, \"input\": \"%s/perf.jpg\", \"outputs\": "
+            "[\"100:%s/s2.jpg\", \"200:%s/s3.jpg\"]}\n", images, tmp, tmp);
+    fclose(fh);
+
+    if (run("'%s' --serve - --dhash -j 1 < %s/jobs > %s/replies 2>/dev/null",
+            bin, tmp, tmp) != 0)
+        return(1);
+    text = read_text("replies");
+    bad = !text || !strstr(text, "\"id\": 1, \"ok\": true") ||
+          !strstr(text, "\"id\": 2, \"ok\": true") || !exists("s1.jpg") ||
+          !exists("s2.jpg") || !exists("s3.jpg");
+    free(text);
+    return(bad);
+}
+
+/* ------------------------------- */
+/*  Utilities.                     */
+/* ------------------------------- */
+
+/* Run a shell command.  Returns its exit status, or -1 if it was killed
+/* (e.g., aborted by a double free). */
+int run(char *fmt, ...)
+{
+    char cmd[1024];
+    va_list ap;
+    int status;
+
+    va_start(ap, fmt);
+    vsnprintf(cmd, sizeof(cmd), fmt, ap);
+    va_end(ap);
+    status = system(cmd);
+    return(WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+}
+
+/* Read a whole file in the temp dir into a string, or NULL. */
+char *read_text(name)
+char *name;
+{
+    char file[128], *text;
+    FILE *fh;
+    long n;
+
+    snprintf(file, sizeof(file), "%s/%s", tmp, name);
+    if ((fh = fopen(file, "rb")) == NULL) return(NULL);
+    fseek(fh, 0, SEEK_END);
+    n = ftell(fh);
+    rewind(fh);
+    text = (char*)malloc(n + 1);
+    text[fread(text, 1, n, fh)] = 0;
+    fclose(fh);
+    return(text);
+}
+
+/* Does a file exist in the temp dir? */
+int exists(name)
+char *name;
+{
+    char file[128];
+    struct stat st;
+
+    snprintf(file, sizeof(file), "%s/%s", tmp, name);
+    return(stat(file, &st) == 0);
+}